@@ -46,11 +46,24 @@ DEFINES += QT_DEPRECATED_WARNINGS
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 HEADERS += \
-    src/bubblecamclient.h
+    src/activitydetector.h \
+    src/bubblecamclient.h \
+    src/bubbleprotocol.h \
+    src/keyframearchive.h \
+    src/memorybudget.h \
+    src/sharedmemoryring.h \
+    src/tracer.h
 
 SOURCES += \
     src/main.cpp \
-    src/bubblecamclient.cpp
+    src/activitydetector.cpp \
+    src/bubblecamclient.cpp \
+    src/keyframearchive.cpp \
+    src/memorybudget.cpp \
+    src/sharedmemoryring.cpp \
+    src/tracer.cpp
+
+unix:!macx: LIBS += -lrt
 
 # Default rules for deployment.
 qnx: target.path = /tmp/$${TARGET}/bin
@@ -0,0 +1,140 @@
+/*
+ *  BubbleCam Client
+ *
+ *  Copyright (c) 2018, Oleksii Serdiuk <contacts[at]oleksii[dot]name>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ *  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ *  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "activitydetector.h"
+
+#include <QLoggingCategory>
+Q_LOGGING_CATEGORY(activityDetectorLog, "bubblecam.ActivityDetector", QtWarningMsg)
+#define DEBUG qCDebug(activityDetectorLog())
+
+// Number of P-slices used to establish the initial baseline
+#define WARMUP_FRAMES 16
+// Weight of a new P-slice in the rolling baseline
+#define BASELINE_ALPHA (1.0 / 64)
+// Weight of a new P-slice while active. Lasting scene changes (e.g. switching to
+// night mode) are eventually absorbed into the baseline, in about a minute at 25
+// fps, while short activity barely moves it.
+#define ACTIVE_BASELINE_ALPHA (1.0 / 4096)
+// Consecutive P-slices over the threshold needed to start activity
+#define START_FRAMES 3
+
+ActivityDetector::ActivityDetector(QObject *parent) : QObject(parent)
+{
+    setSensitivity(m_sensitivity);
+}
+
+void ActivityDetector::setSensitivity(qreal sensitivity)
+{
+    m_sensitivity = qBound<qreal>(0, sensitivity, 1);
+    // From 1.5x (most sensitive) to 6x (least sensitive) of the baseline, with
+    // hysteresis half way back to the baseline
+    m_startThreshold = 1.5 + 4.5 * (1 - m_sensitivity);
+    m_endThreshold = 1 + (m_startThreshold - 1) / 2;
+}
+
+qreal ActivityDetector::sensitivity() const
+{
+    return m_sensitivity;
+}
+
+void ActivityDetector::setHoldFrames(int frames)
+{
+    m_holdFrames = qMax(1, frames);
+}
+
+int ActivityDetector::holdFrames() const
+{
+    return m_holdFrames;
+}
+
+bool ActivityDetector::isActive() const
+{
+    return m_active;
+}
+
+void ActivityDetector::reset()
+{
+    const bool wasActive = m_active;
+    m_idrSize = 0;
+    m_baseline = 0;
+    m_baselineFrames = 0;
+    m_aboveCount = 0;
+    m_belowCount = 0;
+    m_active = false;
+    if (wasActive)
+        emit activityEnded();
+}
+
+void ActivityDetector::addVideoPacket(bool keyFrame, int size)
+{
+    if (keyFrame) {
+        m_idrSize = size;
+        return;
+    }
+    if (m_idrSize <= 0 || size <= 0)
+        return;
+
+    const qreal ratio = qreal(size) / m_idrSize;
+
+    if (m_baselineFrames < WARMUP_FRAMES) {
+        m_baseline = (m_baseline * m_baselineFrames + ratio) / (m_baselineFrames + 1);
+        ++m_baselineFrames;
+        return;
+    }
+
+    const qreal score = ratio / m_baseline;
+
+    if (!m_active) {
+        if (score > m_startThreshold) {
+            if (++m_aboveCount >= START_FRAMES) {
+                DEBUG << "Activity started, score" << score << "baseline" << m_baseline;
+                m_active = true;
+                m_belowCount = 0;
+                emit activityStarted();
+            }
+        } else {
+            m_aboveCount = 0;
+            // Quiet frames contribute fully, so that activity doesn't raise the baseline
+            m_baseline += (ratio - m_baseline) * BASELINE_ALPHA;
+        }
+        return;
+    }
+
+    m_baseline += (ratio - m_baseline) * ACTIVE_BASELINE_ALPHA;
+
+    if (score < m_endThreshold) {
+        if (++m_belowCount >= m_holdFrames) {
+            DEBUG << "Activity ended, score" << score << "baseline" << m_baseline;
+            m_active = false;
+            m_aboveCount = 0;
+            emit activityEnded();
+        }
+    } else {
+        m_belowCount = 0;
+    }
+}
@@ -0,0 +1,79 @@
+/*
+ *  BubbleCam Client
+ *
+ *  Copyright (c) 2018, Oleksii Serdiuk <contacts[at]oleksii[dot]name>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ *  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ *  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ACTIVITYDETECTOR_H
+#define ACTIVITYDETECTOR_H
+
+#include <QObject>
+
+// Detects activity in the video stream without decoding it. Size of each
+// P-slice relative to the size of the last IDR frame is compared against a
+// slowly adapting baseline. Motion in the scene makes P-slices grow, while a
+// static scene keeps them small.
+class ActivityDetector : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit ActivityDetector(QObject *parent = nullptr);
+
+    // Sensitivity in range [0, 1]. Higher values need smaller growth of P-slices
+    // over the baseline to trigger activity.
+    void setSensitivity(qreal sensitivity);
+    qreal sensitivity() const;
+
+    // Number of consecutive quiet P-slices before activity is considered ended.
+    void setHoldFrames(int frames);
+    int holdFrames() const;
+
+    bool isActive() const;
+
+    void reset();
+
+public slots:
+    void addVideoPacket(bool keyFrame, int size);
+
+signals:
+    void activityStarted();
+    void activityEnded();
+
+private:
+    qreal m_sensitivity = 0.5;
+    qreal m_startThreshold;
+    qreal m_endThreshold;
+    int m_holdFrames = 25;
+
+    int m_idrSize = 0;
+    qreal m_baseline = 0;
+    int m_baselineFrames = 0;
+    int m_aboveCount = 0;
+    int m_belowCount = 0;
+    bool m_active = false;
+};
+
+#endif // ACTIVITYDETECTOR_H
@@ -29,16 +29,26 @@
 #define QT_NO_CAST_FROM_ASCII
 
 #include "bubblecamclient.h"
+#include "bubbleprotocol.h"
+#include "keyframearchive.h"
+#include "memorybudget.h"
+#include "sharedmemoryring.h"
+#include "tracer.h"
 
 #include <QDateTime>
+#include <QElapsedTimer>
 #include <QTcpSocket>
 #include <QTimer>
 
-#include <chrono>
+#include <atomic>
 
 #define REQUEST "GET /bubble/live?ch=0&stream=0 HTTP/1.1\r\n\r\n"
 #define REPLY_FAIL_TIMEOUT 5 * 1000
 #define HEARTBEAT_INTERVAL 10 * 1000
+// Limits socket buffering when data isn't consumed fast enough
+#define READ_BUFFER_SIZE 4 * 1024 * 1024
+// Anything larger is treated as a corrupted package header
+#define MAX_PACKAGE_SIZE 16 * 1024 * 1024
 
 #define DEFAULT_PORT 80
 #define DEFAULT_USER "admin"
@@ -50,128 +60,19 @@ Q_LOGGING_CATEGORY(bubbleCamClientLog, "bubblecam.BubbleCamClient", QtWarningMsg
 #define WARNING qCWarning(bubbleCamClientLog())
 #define INFO qCInfo(bubbleCamClientLog())
 
-enum class PackageType : qint8 {
-    Message = 0x00,
-    Media,
-    Heartbeat,
-    OpenChannel = 0x04,
-    OpenStream = 0x0a
-};
-
-enum class MessageType : qint8 {
-    Auth = 0x00,
-    ChannelRequest,
-    PtzControl,
-    AuthReply,
-    ChannelRequestReply
-};
-
-enum class MediaType : qint8 { Audio = 0x00, Idr, PSlice };
-
-template <typename T>
-quint32 packageSize();
-
-#pragma pack(push, 1)
-struct PackageHeader
-{
-    const quint8 magic = 0xaa;
-    quint32 length_be = 0x00;
-    PackageType packageType = PackageType::Message;
-    quint32 timestamp_be = 0x00;
-
-    PackageHeader()
-    {
-        qint64 microsecs = std::chrono::duration_cast<std::chrono::microseconds>(
-                               std::chrono::system_clock::now().time_since_epoch())
-                               .count();
-        // We truncate the most significant bits, as they won't fit into 32 bits
-        timestamp_be = qToBigEndian<quint32>(static_cast<quint32>(microsecs));
-    }
-};
-
-struct Message
-{
-    PackageHeader header;
-    quint32 length_be = 0x00;
-    MessageType messageType;
-    const qint8 reserved[3] = {};
-};
-
-struct AuthMessage
-{
-    Message message;
-    char user[20] = {};
-    char pass[20] = {};
-
-    AuthMessage()
-    {
-        message.header.length_be = qToBigEndian<quint32>(packageSize<AuthMessage>());
-        message.messageType = MessageType::Auth;
-        message.length_be =
-            qToBigEndian<quint32>(sizeof(message.messageType) + sizeof(user) + sizeof(pass));
-    }
-};
+using namespace BubbleProtocol;
 
-struct AuthMessageReply
-{
-    Message message;
-    qint8 verify;
-    const quint8 reserved[3] = {};
-    qint8 auth[32];
-
-    AuthMessageReply()
-    {
-        message.header.length_be = qToBigEndian<quint32>(packageSize<AuthMessageReply>());
-        message.messageType = MessageType::AuthReply;
-        message.length_be = qToBigEndian<quint32>(sizeof(message.messageType) + sizeof(verify)
-                                                  + sizeof(reserved) + sizeof(auth));
-    }
-};
-
-struct OpenStreamMessage
-{
-    PackageHeader header;
-    quint32 channel = 0x00;
-    quint32 stream = 0x00;
-    quint32 opened = 0x00;
-    quint32 reserved = 0x00;
-
-    OpenStreamMessage()
-    {
-        header.packageType = PackageType::OpenStream;
-        header.length_be = qToBigEndian<quint32>(packageSize<OpenStreamMessage>());
-    }
-};
+static std::atomic<quint32> lastSessionId(0);
 
-struct HeartbeatMessage
+BubbleCamClient::BubbleCamClient() : m_sessionId(++lastSessionId)
 {
-    PackageHeader header;
-    qint8 payload = 0x02; // Seems to laways be 0x02
-
-    HeartbeatMessage()
-    {
-        header.packageType = PackageType::Heartbeat;
-        header.length_be = qToBigEndian<quint32>(packageSize<HeartbeatMessage>());
-    }
-};
-
-struct MediaMessage
-{
-    PackageHeader header;
-    quint32 length_be;
-    MediaType mediaType;
-    qint8 channelId;
-};
-#pragma pack(pop)
-
-template <typename T>
-quint32 packageSize()
-{
-    return sizeof(T) - sizeof(PackageHeader::magic) - sizeof(PackageHeader::length_be);
+    // Buffers are only touched from our own thread, the budget just asks for it
+    m_memory.setOverloadHandler([this]() {
+        if (!m_dropRequested.exchange(true))
+            QMetaObject::invokeMethod(this, "onMemoryOverload", Qt::QueuedConnection);
+    });
 }
 
-BubbleCamClient::BubbleCamClient() {}
-
 BubbleCamClient::ErrorCode BubbleCamClient::startStreaming(const QHostAddress &hostName,
                                                            quint16 port, const QString &user,
                                                            const QString &password, quint8 channel,
@@ -180,7 +81,9 @@ BubbleCamClient::ErrorCode BubbleCamClient::startStreaming(const QHostAddress &h
     if (m_streaming)
         return ErrorCode::AlreadyStreaming;
 
-    if (user.length() > 20 || password.length() > 20)
+    // Limits are in bytes of the encoded credentials, not in characters
+    if (user.toUtf8().size() > AuthMessage::User::size
+        || password.toUtf8().size() > AuthMessage::Password::size)
         return ErrorCode::UsernameOrPasswordTooLong;
 
     QScopedPointer<QTcpSocket> socket(new QTcpSocket());
@@ -188,68 +91,40 @@ BubbleCamClient::ErrorCode BubbleCamClient::startStreaming(const QHostAddress &h
     if (!socket->waitForConnected())
         return ErrorCode::ConnectionTimeout;
 
-    socket->write(REQUEST);
-    if (!socket->waitForBytesWritten())
-        return ErrorCode::WriteTimeout;
-    if (!socket->waitForReadyRead(REPLY_FAIL_TIMEOUT))
-        return ErrorCode::ReadTimeout;
-
-    QByteArray reply = socket->readAll();
-    const int i = reply.indexOf('\x00');
-    if (i >= 0) {
-        reply.truncate(i);
-    }
-    DEBUG << reply.size() << reply;
-
-    AuthMessage auth;
-    strcpy(auth.user, user.toUtf8().constData());
-    strcpy(auth.pass, password.toUtf8().constData());
-
-    QByteArray auth_package(reinterpret_cast<char *>(&auth), sizeof(AuthMessage));
-    DEBUG << auth_package.size() << auth_package.toHex();
-    socket->write(auth_package);
-    if (!socket->waitForBytesWritten())
-        return ErrorCode::WriteTimeout;
-    if (!socket->waitForReadyRead(REPLY_FAIL_TIMEOUT))
-        return ErrorCode::ReadTimeout;
-    reply = socket->readAll();
-    DEBUG << reply.size() << reply.toHex();
-
-    if (!reply.startsWith('\xaa'))
-        return ErrorCode::UnexpectedReply;
-
-    {
-        const PackageHeader *header = reinterpret_cast<const PackageHeader *>(reply.constData());
-        if (header->packageType != PackageType::Message)
-            return ErrorCode::UnexpectedReply;
-        const Message *message = reinterpret_cast<const Message *>(reply.constData());
-        if (message->messageType != MessageType::AuthReply)
-            return ErrorCode::UnexpectedReply;
-        const AuthMessageReply *authReply =
-            reinterpret_cast<const AuthMessageReply *>(reply.constData());
-        if (authReply->verify == 0)
-            return ErrorCode::AuthenticationFailed;
+    QByteArray pending;
+    ErrorCode error;
+    if (m_fastStart) {
+        error = pipelinedHandshake(socket.data(), user, password, channel, stream, &pending);
+        switch (error) {
+        case ErrorCode::ReadTimeout:
+        case ErrorCode::WriteTimeout:
+        case ErrorCode::UnexpectedReply:
+        case ErrorCode::OpenStreamFailed:
+            // Camera might not support pipelining, retry the usual way
+            INFO << "Fast start failed, falling back to step-by-step handshake:" << error;
+            pending.clear();
+            socket->abort();
+            socket->connectToHost(hostName, port);
+            if (!socket->waitForConnected())
+                return ErrorCode::ConnectionTimeout;
+            error = handshake(socket.data(), user, password, channel, stream);
+            break;
+        default:
+            break;
+        }
+    } else {
+        error = handshake(socket.data(), user, password, channel, stream);
     }
-
-    OpenStreamMessage open_stream;
-    open_stream.channel = channel;
-    open_stream.stream = stream;
-    open_stream.opened = 0x01;
-
-    QByteArray open_stream_package(reinterpret_cast<char *>(&open_stream),
-                                   sizeof(OpenStreamMessage));
-    DEBUG << open_stream_package.size() << open_stream_package.toHex();
-    socket->write(open_stream_package);
-    if (!socket->waitForBytesWritten())
-        return ErrorCode::WriteTimeout;
-    if (!socket->waitForReadyRead(REPLY_FAIL_TIMEOUT))
-        return ErrorCode::OpenStreamFailed;
+    if (error != ErrorCode::NoError)
+        return error;
 
     m_channel = channel;
     m_stream = stream;
+    m_resync = false;
     m_streaming = true;
 
     m_socket.reset(socket.take());
+    m_socket->setReadBufferSize(READ_BUFFER_SIZE);
     connect(m_socket.data(), &QTcpSocket::readyRead, this, &BubbleCamClient::onReadyRead);
     connect(m_socket.data(), &QTcpSocket::disconnected, this, &BubbleCamClient::onDisconnected);
     connect(m_socket.data(), SIGNAL(error(QAbstractSocket::SocketError)),
@@ -260,6 +135,13 @@ BubbleCamClient::ErrorCode BubbleCamClient::startStreaming(const QHostAddress &h
             &BubbleCamClient::onHeartbeatTimerTimeout);
     m_heartbeatTimer->start(HEARTBEAT_INTERVAL);
 
+    // Stream data that arrived together with the handshake replies is processed
+    // once the caller had a chance to connect to our signals.
+    if (!pending.isEmpty()) {
+        m_pendingData = pending;
+        QMetaObject::invokeMethod(this, "onReadyRead", Qt::QueuedConnection);
+    }
+
     return ErrorCode::NoError;
 }
 
@@ -277,12 +159,62 @@ BubbleCamClient::ErrorCode BubbleCamClient::startStreaming(const QHostAddress &h
                           stream);
 }
 
+void BubbleCamClient::setFastStart(bool enabled)
+{
+    m_fastStart = enabled;
+}
+
+bool BubbleCamClient::fastStart() const
+{
+    return m_fastStart;
+}
+
+quint32 BubbleCamClient::sessionId() const
+{
+    return m_sessionId;
+}
+
+void BubbleCamClient::setOverloadPolicy(OverloadPolicy policy)
+{
+    m_overloadPolicy = policy;
+}
+
+BubbleCamClient::OverloadPolicy BubbleCamClient::overloadPolicy() const
+{
+    return m_overloadPolicy;
+}
+
+void BubbleCamClient::setKeyFramesOnly(bool enabled, int intervalMsecs)
+{
+    m_keyFramesOnly = enabled;
+    m_keyFrameInterval = intervalMsecs;
+    m_lastKeyFrame.invalidate();
+}
+
+bool BubbleCamClient::keyFramesOnly() const
+{
+    return m_keyFramesOnly;
+}
+
+void BubbleCamClient::setKeyFrameArchive(KeyFrameArchive *archive)
+{
+    m_archive = archive;
+}
+
+void BubbleCamClient::setSharedMemoryRing(SharedMemoryRing *ring)
+{
+    m_ring = ring;
+}
+
 void BubbleCamClient::stopStreaming()
 {
     if (!m_streaming)
         return;
 
     m_streaming = false;
+    m_pendingData.clear();
+    m_memory.setUsage(MemoryBudget::Category::ReceiveBuffer, 0);
+    m_memory.setUsage(MemoryBudget::Category::ReassemblyBuffer, 0);
 
     if (m_heartbeatTimer) {
         m_heartbeatTimer->stop();
@@ -290,28 +222,25 @@ void BubbleCamClient::stopStreaming()
     }
 
     if (m_socket) {
-        OpenStreamMessage open_stream;
-        open_stream.channel = m_channel;
-        open_stream.stream = m_stream;
-        open_stream.opened = 0x00;
-
-        QByteArray open_stream_package(reinterpret_cast<char *>(&open_stream),
-                                       sizeof(OpenStreamMessage));
-        DEBUG << open_stream_package.size() << open_stream_package.toHex();
-        m_socket->write(open_stream_package);
+        char open_stream_package[OpenStreamMessage::size];
+        OpenStreamMessage::encode(open_stream_package, m_channel, m_stream, false,
+                                  currentTimestamp());
+        DEBUG << sizeof(open_stream_package)
+              << QByteArray::fromRawData(open_stream_package, sizeof(open_stream_package)).toHex();
+        m_socket->write(open_stream_package, sizeof(open_stream_package));
         if (!m_socket->waitForBytesWritten()) {
             m_socket->close();
-            m_socket.reset();
-            return;
-        }
-
-        m_socket->disconnectFromHost();
+        } else {
+            m_socket->disconnectFromHost();
 
-        if (m_socket->state() != QTcpSocket::UnconnectedState) {
-            m_socket->waitForDisconnected();
+            if (m_socket->state() != QTcpSocket::UnconnectedState) {
+                m_socket->waitForDisconnected();
+            }
         }
         m_socket.reset();
     }
+
+    emit streamingStopped();
 }
 
 BubbleCamClient::~BubbleCamClient()
@@ -320,33 +249,225 @@ BubbleCamClient::~BubbleCamClient()
         stopStreaming();
 }
 
+BubbleCamClient::ErrorCode BubbleCamClient::handshake(QTcpSocket *socket, const QString &user,
+                                                      const QString &password, quint8 channel,
+                                                      quint8 stream)
+{
+    socket->write(REQUEST);
+    if (!socket->waitForBytesWritten())
+        return ErrorCode::WriteTimeout;
+    if (!socket->waitForReadyRead(REPLY_FAIL_TIMEOUT))
+        return ErrorCode::ReadTimeout;
+
+    QByteArray reply = socket->readAll();
+    const int i = reply.indexOf('\x00');
+    if (i >= 0) {
+        reply.truncate(i);
+    }
+    DEBUG << reply.size() << reply;
+
+    char auth_package[AuthMessage::size];
+    AuthMessage::encode(auth_package, user.toUtf8(), password.toUtf8(), currentTimestamp());
+    DEBUG << sizeof(auth_package)
+          << QByteArray::fromRawData(auth_package, sizeof(auth_package)).toHex();
+    socket->write(auth_package, sizeof(auth_package));
+    if (!socket->waitForBytesWritten())
+        return ErrorCode::WriteTimeout;
+    if (!socket->waitForReadyRead(REPLY_FAIL_TIMEOUT))
+        return ErrorCode::ReadTimeout;
+    reply.clear();
+    int offset = 0;
+    int replySize = 0;
+    ErrorCode error = readAuthReply(socket, &reply, &offset, &replySize);
+    if (error != ErrorCode::NoError)
+        return error;
+    DEBUG << reply.size() << reply.toHex();
+
+    error = checkAuthReply(reply.constData() + offset, replySize);
+    if (error != ErrorCode::NoError)
+        return error;
+
+    char open_stream_package[OpenStreamMessage::size];
+    OpenStreamMessage::encode(open_stream_package, channel, stream, true, currentTimestamp());
+    DEBUG << sizeof(open_stream_package)
+          << QByteArray::fromRawData(open_stream_package, sizeof(open_stream_package)).toHex();
+    socket->write(open_stream_package, sizeof(open_stream_package));
+    if (!socket->waitForBytesWritten())
+        return ErrorCode::WriteTimeout;
+    if (!socket->waitForReadyRead(REPLY_FAIL_TIMEOUT))
+        return ErrorCode::OpenStreamFailed;
+
+    return ErrorCode::NoError;
+}
+
+BubbleCamClient::ErrorCode BubbleCamClient::pipelinedHandshake(QTcpSocket *socket,
+                                                               const QString &user,
+                                                               const QString &password,
+                                                               quint8 channel, quint8 stream,
+                                                               QByteArray *pending)
+{
+    QByteArray request(REQUEST);
+    const int requestSize = request.size();
+    request.resize(requestSize + AuthMessage::size + OpenStreamMessage::size);
+    char *data = request.data();
+    AuthMessage::encode(data + requestSize, user.toUtf8(), password.toUtf8(), currentTimestamp());
+    OpenStreamMessage::encode(data + requestSize + AuthMessage::size, channel, stream, true,
+                              currentTimestamp());
+    DEBUG << request.size() << request.toHex();
+    socket->write(request);
+    if (!socket->waitForBytesWritten())
+        return ErrorCode::WriteTimeout;
+
+    QByteArray reply;
+    int offset = 0;
+    int replySize = 0;
+    ErrorCode error = readAuthReply(socket, &reply, &offset, &replySize);
+    if (error != ErrorCode::NoError)
+        return error;
+    DEBUG << offset << reply.left(offset) << reply.mid(offset, replySize).toHex();
+
+    error = checkAuthReply(reply.constData() + offset, replySize);
+    if (error != ErrorCode::NoError)
+        return error;
+
+    // Stream is considered open once the first media package header arrives
+    QByteArray media = reply.mid(offset + replySize);
+    while (media.size() < MediaMessage::size) {
+        if (!socket->waitForReadyRead(REPLY_FAIL_TIMEOUT))
+            return ErrorCode::OpenStreamFailed;
+        media.append(socket->readAll());
+    }
+
+    MediaMessage message;
+    if (!media.startsWith('\xaa')
+        || !MediaMessage::decode(media.constData(), media.size(), &message)
+        || message.header.packageType != PackageType::Media) {
+        WARNING << "Unexpected reply to pipelined open stream:"
+                << media.left(MediaMessage::size).toHex();
+        return ErrorCode::OpenStreamFailed;
+    }
+
+    *pending = media;
+    return ErrorCode::NoError;
+}
+
+// Reads until the whole authentication reply has arrived. HTTP reply is text, so
+// the first magic byte starts the AuthMessageReply. On success, offset and size
+// locate the reply in the buffer, which might also contain data that follows it.
+BubbleCamClient::ErrorCode BubbleCamClient::readAuthReply(QTcpSocket *socket, QByteArray *reply,
+                                                          int *offset, int *size)
+{
+    *offset = reply->indexOf('\xaa');
+    while (*offset < 0 || reply->size() - *offset < AuthMessageReply::Verify::end) {
+        if (!socket->waitForReadyRead(REPLY_FAIL_TIMEOUT))
+            return ErrorCode::ReadTimeout;
+        reply->append(socket->readAll());
+        *offset = reply->indexOf('\xaa');
+    }
+
+    // Firmwares may send a longer reply, so skip it by the length in its header,
+    // which doesn't include the magic and the length fields themselves
+    PackageHeader header;
+    PackageHeader::decode(reply->constData() + *offset, reply->size() - *offset, &header);
+    const qint64 replySize = qint64(header.length) + PackageHeader::Length::end;
+    if (replySize < AuthMessageReply::Verify::end || replySize > MAX_PACKAGE_SIZE) {
+        WARNING << "Unexpected authentication reply size:" << replySize;
+        return ErrorCode::UnexpectedReply;
+    }
+    while (reply->size() - *offset < replySize) {
+        if (!socket->waitForReadyRead(REPLY_FAIL_TIMEOUT))
+            return ErrorCode::ReadTimeout;
+        reply->append(socket->readAll());
+    }
+
+    *size = int(replySize);
+    return ErrorCode::NoError;
+}
+
+BubbleCamClient::ErrorCode BubbleCamClient::checkAuthReply(const char *data, int size)
+{
+    AuthMessageReply authReply;
+    if (!AuthMessageReply::decode(data, size, &authReply))
+        return ErrorCode::UnexpectedReply;
+    if (authReply.message.header.packageType != PackageType::Message)
+        return ErrorCode::UnexpectedReply;
+    if (authReply.message.messageType != MessageType::AuthReply)
+        return ErrorCode::UnexpectedReply;
+    if (authReply.verify == 0)
+        return ErrorCode::AuthenticationFailed;
+    return ErrorCode::NoError;
+}
+
 int BubbleCamClient::processMessage(const QByteArray &data)
 {
-    const MediaMessage *message = reinterpret_cast<const MediaMessage *>(data.constData());
-    const qint32 size = static_cast<qint32>(qFromBigEndian<quint32>(message->length_be));
+    MediaMessage message;
+    bool decoded;
+    {
+        TRACE_SPAN("header parse", m_sessionId);
+        decoded = MediaMessage::decode(data.constData(), data.size(), &message);
+    }
+    if (!decoded) {
+        WARNING << "Package too short:" << data.size();
+        return emitData(data.left(1));
+    }
+    if (message.length > MAX_PACKAGE_SIZE) {
+        WARNING << "Package too large:" << message.length;
+        return emitData(data.left(1));
+    }
+    const qint32 size = static_cast<qint32>(message.length);
 
-    DEBUG << "Got message" << qint8(message->header.packageType) << qint8(message->mediaType)
+    DEBUG << "Got message" << qint8(message.header.packageType) << qint8(message.mediaType)
           << size;
 
-    if (message->header.packageType != PackageType::Media) {
-        WARNING << "Package not of Media type:" << qint8(message->header.packageType);
+    if (message.header.packageType != PackageType::Media) {
+        WARNING << "Package not of Media type:" << qint8(message.header.packageType);
+        Message msg;
         if (bubbleCamClientLog().isDebugEnabled()
-            && message->header.packageType == PackageType::Message
-            && data.size() >= sizeof(Message)) {
-            const Message *message = reinterpret_cast<const Message *>(data.constData());
-            DEBUG << qint8(message->messageType) << data.size()
-                  << data.left(sizeof(Message)).toHex();
+            && message.header.packageType == PackageType::Message
+            && Message::decode(data.constData(), data.size(), &msg)) {
+            DEBUG << qint8(msg.messageType) << data.size() << data.left(Message::size).toHex();
         }
         return emitData(data.left(1));
     }
 
-    const QByteArray messageData = data.mid(sizeof(MediaMessage), size);
+    m_resync = false;
+    audioActive = message.mediaType == MediaType::Audio;
+    if (message.mediaType == MediaType::Idr || message.mediaType == MediaType::PSlice)
+        emit videoPacketReceived(message.mediaType == MediaType::Idr, size);
+
+    // Skipped payload is never copied, onReadyRead() jumps over the rest of it
+    skipPacket = m_keyFramesOnly && !acceptKeyFrame(message.mediaType == MediaType::Idr);
+    if (skipPacket) {
+        const int available = qMin(size, data.size() - int(MediaMessage::size));
+        packet_left = size - available;
+        return MediaMessage::size + available;
+    }
+
+    const QByteArray messageData = data.mid(MediaMessage::size, size);
     packet_left = size - messageData.size();
-    audioActive = message->mediaType == MediaType::Audio;
+    if (m_archive && message.mediaType == MediaType::Idr) {
+        m_archive->beginFrame(quint32(size));
+        m_archive->appendFrame(messageData.constData(), messageData.size());
+    }
+    if (m_ring) {
+        switch (message.mediaType) {
+        case MediaType::Audio:
+        case MediaType::Idr:
+        case MediaType::PSlice:
+            m_ring->beginPacket(static_cast<SharedMemoryRing::PacketType>(message.mediaType),
+                                quint8(message.channelId), message.header.timestamp,
+                                quint32(qMax(0, size)));
+            m_ring->appendPacket(messageData.constData(), messageData.size());
+            break;
+        default:
+            break;
+        }
+    }
     if (messageData.isEmpty())
-        return sizeof(MediaMessage);
+        return MediaMessage::size;
 
-    switch (message->mediaType) {
+    TRACE_SPAN("payload emit", m_sessionId);
+    switch (message.mediaType) {
     case MediaType::Audio:
         DEBUG << "Audio size:" << messageData.size();
         emit audioStream(messageData);
@@ -358,15 +479,39 @@ int BubbleCamClient::processMessage(const QByteArray &data)
         emit videoStream(messageData);
         break;
     default:
-        WARNING << "Unknown media type:" << qint8(message->mediaType);
+        WARNING << "Unknown media type:" << qint8(message.mediaType);
         return emitData(data.left(1));
     }
-    return sizeof(MediaMessage) + messageData.size();
+    return MediaMessage::size + messageData.size();
+}
+
+bool BubbleCamClient::acceptKeyFrame(bool keyFrame)
+{
+    if (!keyFrame)
+        return false;
+    if (m_keyFrameInterval <= 0)
+        return true;
+
+    if (m_lastKeyFrame.isValid() && !m_lastKeyFrame.hasExpired(m_keyFrameInterval))
+        return false;
+    m_lastKeyFrame.start();
+    return true;
 }
 
 int BubbleCamClient::emitData(const QByteArray &data)
 {
+    if (packet_left > 0) {
+        if (m_ring)
+            m_ring->appendPacket(data.constData(), qMin(packet_left, data.size()));
+        if (m_archive)
+            m_archive->appendFrame(data.constData(), qMin(packet_left, data.size()));
+    }
     packet_left = qMax(0, packet_left - data.size());
+    // Whatever precedes the next package header after a drop belongs to a lost
+    // package, possibly of the other media type
+    if (m_resync)
+        return data.size();
+    TRACE_SPAN("payload emit", m_sessionId);
     if (audioActive) {
         emit audioStream(data);
     } else {
@@ -377,30 +522,89 @@ int BubbleCamClient::emitData(const QByteArray &data)
 
 void BubbleCamClient::onReadyRead()
 {
-    QByteArray data = m_socket->readAll();
+    if (!m_socket)
+        return;
+
+    QByteArray data = m_pendingData;
+    m_pendingData.clear();
+    {
+        TRACE_SPAN("socket read", m_sessionId);
+        data.append(m_socket->readAll());
+    }
     //    DEBUG << data.size();
 
+    // Might be over the limit because of this very read, don't wait for the
+    // queued request then
+    m_memory.setUsage(MemoryBudget::Category::ReceiveBuffer, data.size());
+    if (m_dropRequested.load()) {
+        data.clear();
+        onMemoryOverload();
+        return;
+    }
+
     int offset = 0;
     while (offset < data.size()) {
-        const int newOffset = data.indexOf('\xaa', offset + packet_left);
+        // Rest of the current package is payload, even if it contains magic bytes
+        if (packet_left > 0) {
+            const int available = qMin(packet_left, data.size() - offset);
+            if (skipPacket)
+                packet_left -= available;
+            else
+                emitData(data.mid(offset, available));
+            offset += available;
+            continue;
+        }
+
+        const int newOffset = data.indexOf('\xaa', offset);
         if (newOffset > offset) {
-            emitData(data.left(newOffset));
+            emitData(data.mid(offset, newOffset - offset));
             offset = newOffset;
         }
 
-        QByteArray mid = data.mid(offset);
+        // Refers to the read buffer, so that headers are parsed without copying it
+        const QByteArray mid = QByteArray::fromRawData(data.constData() + offset,
+                                                       data.size() - offset);
         if (mid.startsWith('\xaa')) {
-            // We might have a split MediaMessage, wait for more data
-            while (mid.size() < sizeof(MediaMessage)) {
-                m_socket->waitForReadyRead();
-                data.append(m_socket->readAll());
-                mid = data.mid(offset);
+            // We might have a split MediaMessage, keep it until more data arrives
+            if (mid.size() < MediaMessage::size) {
+                m_pendingData = QByteArray(mid.constData(), mid.size());
+                break;
             }
             offset += processMessage(mid);
         } else {
-            offset += emitData(mid);
+            offset += emitData(data.mid(offset));
         }
     }
+
+    // Socket might have been closed by one of the slots connected to our signals
+    m_memory.setUsage(MemoryBudget::Category::ReceiveBuffer,
+                      m_socket ? m_socket->bytesAvailable() : 0);
+    m_memory.setUsage(MemoryBudget::Category::ReassemblyBuffer, m_pendingData.size());
+}
+
+void BubbleCamClient::onMemoryOverload()
+{
+    // Already handled directly in onReadyRead()
+    if (!m_dropRequested.exchange(false))
+        return;
+
+    WARNING << "Memory limit reached, dropping buffered data of session" << m_sessionId;
+    m_resync = true;
+    m_pendingData.clear();
+    packet_left = 0;
+    if (m_ring)
+        m_ring->abortPacket();
+    if (m_archive)
+        m_archive->abortFrame();
+    if (m_socket)
+        m_socket->readAll();
+    m_memory.setUsage(MemoryBudget::Category::ReceiveBuffer, 0);
+    m_memory.setUsage(MemoryBudget::Category::ReassemblyBuffer, 0);
+
+    if (m_overloadPolicy == OverloadPolicy::Disconnect) {
+        // Might be called from within our own slots
+        QMetaObject::invokeMethod(this, "stopStreaming", Qt::QueuedConnection);
+    }
 }
 
 void BubbleCamClient::onDisconnected()
@@ -427,8 +631,9 @@ void BubbleCamClient::onHeartbeatTimerTimeout()
 {
     INFO << "Sending heartbeat";
 
-    HeartbeatMessage heartbeat;
-    QByteArray heartbeat_package(reinterpret_cast<char *>(&heartbeat), sizeof(HeartbeatMessage));
-    DEBUG << heartbeat_package.size() << heartbeat_package.toHex();
-    m_socket->write(heartbeat_package);
+    char heartbeat_package[HeartbeatMessage::size];
+    HeartbeatMessage::encode(heartbeat_package, currentTimestamp());
+    DEBUG << sizeof(heartbeat_package)
+          << QByteArray::fromRawData(heartbeat_package, sizeof(heartbeat_package)).toHex();
+    m_socket->write(heartbeat_package, sizeof(heartbeat_package));
 }
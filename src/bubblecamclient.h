@@ -29,16 +29,22 @@
 #ifndef BUBBLECAMCLIENT_H
 #define BUBBLECAMCLIENT_H
 
+#include "memorybudget.h"
+
 #include <QtEndian>
 
+#include <QElapsedTimer>
 #include <QObject>
 #include <QHostAddress>
 
+#include <atomic>
 #include <chrono>
 
 class QTcpSocket;
 class QTimer;
 class QFile;
+class KeyFrameArchive;
+class SharedMemoryRing;
 class BubbleCamClient : public QObject
 {
     Q_OBJECT
@@ -57,6 +63,10 @@ public:
     };
     Q_ENUM(ErrorCode)
 
+    // What to do when the process-wide memory limit is exceeded
+    enum struct OverloadPolicy : quint8 { DropBuffered, Disconnect };
+    Q_ENUM(OverloadPolicy)
+
 public:
     BubbleCamClient();
 
@@ -67,30 +77,86 @@ public:
                              quint8 stream = 0);
     ErrorCode startStreaming(const QHostAddress &hostName, quint8 stream);
 
-    void stopStreaming();
+    Q_INVOKABLE void stopStreaming();
+
+    // When enabled, the HTTP request, authentication and open stream packages are
+    // sent without waiting for replies. Falls back to the step-by-step handshake if
+    // the camera doesn't accept it.
+    void setFastStart(bool enabled);
+    bool fastStart() const;
+
+    void setOverloadPolicy(OverloadPolicy policy);
+    OverloadPolicy overloadPolicy() const;
+
+    // Drops everything but IDR frames before the payload is copied out of the
+    // receive buffer, for all outputs. With a positive interval, at most one IDR
+    // frame per interval is kept.
+    void setKeyFramesOnly(bool enabled, int intervalMsecs = 0);
+    bool keyFramesOnly() const;
+
+    // Additionally writes IDR frames into the archive. The archive is not owned by
+    // the client and must outlive the stream.
+    void setKeyFrameArchive(KeyFrameArchive *archive);
+
+    // Additionally publishes complete media packages into the ring. The ring is
+    // not owned by the client and must outlive the stream.
+    void setSharedMemoryRing(SharedMemoryRing *ring);
+
+    // Process-wide unique identifier, used to tell sessions apart in traces
+    quint32 sessionId() const;
 
     virtual ~BubbleCamClient();
 
 signals:
     void videoStream(const QByteArray &data);
     void audioStream(const QByteArray &data);
+    // Emitted for each video package header with the full payload size, before
+    // the payload itself is received.
+    void videoPacketReceived(bool keyFrame, int size);
+    // Emitted when the stream is stopped, either explicitly or due to an error
+    void streamingStopped();
 
 private slots:
     void onReadyRead();
     void onDisconnected();
     void onError(QAbstractSocket::SocketError socketError);
     void onHeartbeatTimerTimeout();
+    void onMemoryOverload();
 
 private:
+    const quint32 m_sessionId;
     bool m_streaming = false;
+    bool m_fastStart = false;
     quint8 m_channel;
     quint8 m_stream;
     QScopedPointer<QTcpSocket> m_socket;
     QScopedPointer<QTimer> m_heartbeatTimer;
+    QByteArray m_pendingData;
+    SharedMemoryRing *m_ring = nullptr;
+    KeyFrameArchive *m_archive = nullptr;
+    bool m_keyFramesOnly = false;
+    int m_keyFrameInterval = 0;
+    QElapsedTimer m_lastKeyFrame;
+    // Set by the memory budget from any thread, must outlive m_memory
+    std::atomic<bool> m_dropRequested{ false };
+    MemoryBudget::Account m_memory;
+    OverloadPolicy m_overloadPolicy = OverloadPolicy::DropBuffered;
+    // Set after buffered data was dropped, until the next media package header
+    bool m_resync = false;
 
     qint32 packet_left = 0;
     bool audioActive = false;
+    bool skipPacket = false;
+
+    ErrorCode handshake(QTcpSocket *socket, const QString &user, const QString &password,
+                        quint8 channel, quint8 stream);
+    ErrorCode pipelinedHandshake(QTcpSocket *socket, const QString &user,
+                                 const QString &password, quint8 channel, quint8 stream,
+                                 QByteArray *pending);
+    ErrorCode readAuthReply(QTcpSocket *socket, QByteArray *reply, int *offset, int *size);
+    ErrorCode checkAuthReply(const char *data, int size);
 
+    bool acceptKeyFrame(bool keyFrame);
     int processMessage(const QByteArray &data);
     int emitData(const QByteArray &data);
 };
@@ -0,0 +1,329 @@
+/*
+ *  BubbleCam Client
+ *
+ *  Copyright (c) 2018, Oleksii Serdiuk <contacts[at]oleksii[dot]name>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ *  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ *  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BUBBLEPROTOCOL_H
+#define BUBBLEPROTOCOL_H
+
+#include <QByteArray>
+#include <QtEndian>
+#include <QtGlobal>
+
+#include <chrono>
+#include <cstring>
+#include <type_traits>
+
+namespace BubbleProtocol {
+
+enum class PackageType : qint8 {
+    Message = 0x00,
+    Media,
+    Heartbeat,
+    OpenChannel = 0x04,
+    OpenStream = 0x0a
+};
+
+enum class MessageType : qint8 {
+    Auth = 0x00,
+    ChannelRequest,
+    PtzControl,
+    AuthReply,
+    ChannelRequestReply
+};
+
+enum class MediaType : qint8 { Audio = 0x00, Idr, PSlice };
+
+enum class ByteOrder { BigEndian, LittleEndian };
+
+const quint8 Magic = 0xaa;
+
+template <typename T, bool = std::is_enum<T>::value>
+struct WireType
+{
+    typedef typename std::underlying_type<T>::type Type;
+};
+
+template <typename T>
+struct WireType<T, false>
+{
+    typedef T Type;
+};
+
+// Describes a single integer (or enum) field at a fixed offset of the wire
+// layout. Reads and writes go through memcpy, so the buffer doesn't have to be
+// aligned, and the byte swap is picked at compile time.
+template <typename T, int Offset, ByteOrder Order = ByteOrder::BigEndian>
+struct Field
+{
+    typedef T Type;
+    typedef typename WireType<T>::Type Raw;
+    enum : int { offset = Offset, size = sizeof(Raw), end = Offset + int(sizeof(Raw)) };
+
+    static T read(const char *data)
+    {
+        Raw raw;
+        std::memcpy(&raw, data + Offset, sizeof(Raw));
+        return static_cast<T>(Order == ByteOrder::BigEndian ? qFromBigEndian(raw)
+                                                             : qFromLittleEndian(raw));
+    }
+
+    static void write(char *data, T value)
+    {
+        const Raw raw = Order == ByteOrder::BigEndian ? qToBigEndian(static_cast<Raw>(value))
+                                                      : qToLittleEndian(static_cast<Raw>(value));
+        std::memcpy(data + Offset, &raw, sizeof(Raw));
+    }
+};
+
+// Fixed-size, zero-padded byte array field (e.g. user name or password).
+template <int Offset, int Size>
+struct BytesField
+{
+    enum : int { offset = Offset, size = Size, end = Offset + Size };
+
+    static void read(const char *data, char *out) { std::memcpy(out, data + Offset, Size); }
+
+    static void write(char *data, const char *value, int length)
+    {
+        const int n = qBound(0, length, int(Size));
+        std::memcpy(data + Offset, value, n);
+        std::memset(data + Offset + n, 0, Size - n);
+    }
+};
+
+template <int Offset, int Size>
+struct ReservedField
+{
+    enum : int { offset = Offset, size = Size, end = Offset + Size };
+
+    static void write(char *data) { std::memset(data + Offset, 0, Size); }
+};
+
+// Validates at compile time that the fields follow each other without gaps and
+// provides the total size of the layout.
+template <int Begin, typename... Fields>
+struct Layout;
+
+template <int Begin>
+struct Layout<Begin>
+{
+    enum : int { begin = Begin, end = Begin };
+};
+
+template <int Begin, typename First, typename... Rest>
+struct Layout<Begin, First, Rest...>
+{
+    static_assert(First::offset == Begin, "Field is not contiguous with the previous one");
+    enum : int { begin = Begin, end = Layout<First::end, Rest...>::end };
+};
+
+// Size of the package as reported in the header, i.e. without the magic and
+// the length fields themselves.
+template <typename Package>
+constexpr quint32 packageSize()
+{
+    return Package::size - 5;
+}
+
+struct PackageHeader
+{
+    typedef Field<quint8, 0> Magic;
+    typedef Field<quint32, 1> Length;
+    typedef Field<PackageType, 5> Type;
+    typedef Field<quint32, 6> Timestamp;
+    enum : int { size = Layout<0, Magic, Length, Type, Timestamp>::end };
+
+    quint32 length = 0;
+    PackageType packageType = PackageType::Message;
+    quint32 timestamp = 0;
+
+    static void encode(char *data, PackageType type, quint32 length, quint32 timestamp)
+    {
+        Magic::write(data, BubbleProtocol::Magic);
+        Length::write(data, length);
+        Type::write(data, type);
+        Timestamp::write(data, timestamp);
+    }
+
+    // Doesn't check the magic byte, as the caller has already found the start of
+    // the package by it. Like the other decoders, only needs the bytes up to the
+    // last field it reads.
+    static bool decode(const char *data, int available, PackageHeader *header)
+    {
+        if (Q_UNLIKELY(available < Timestamp::end))
+            return false;
+        header->length = Length::read(data);
+        header->packageType = Type::read(data);
+        header->timestamp = Timestamp::read(data);
+        return true;
+    }
+};
+
+struct Message
+{
+    typedef Field<quint32, PackageHeader::size> Length;
+    typedef Field<MessageType, Length::end> Type;
+    typedef ReservedField<Type::end, 3> Reserved;
+    enum : int { size = Layout<PackageHeader::size, Length, Type, Reserved>::end };
+
+    PackageHeader header;
+    MessageType messageType = MessageType::Auth;
+
+    static void encode(char *data, quint32 packageSize, MessageType type, quint32 length,
+                       quint32 timestamp)
+    {
+        PackageHeader::encode(data, PackageType::Message, packageSize, timestamp);
+        Length::write(data, length);
+        Type::write(data, type);
+        Reserved::write(data);
+    }
+
+    static bool decode(const char *data, int available, Message *message)
+    {
+        if (Q_UNLIKELY(available < Type::end))
+            return false;
+        PackageHeader::decode(data, available, &message->header);
+        message->messageType = Type::read(data);
+        return true;
+    }
+};
+
+struct AuthMessage
+{
+    typedef BytesField<Message::size, 20> User;
+    typedef BytesField<User::end, 20> Password;
+    enum : int { size = Layout<Message::size, User, Password>::end };
+
+    static void encode(char *data, const QByteArray &user, const QByteArray &password,
+                       quint32 timestamp)
+    {
+        Message::encode(data, packageSize<AuthMessage>(), MessageType::Auth,
+                        Message::Type::size + User::size + Password::size, timestamp);
+        User::write(data, user.constData(), user.size());
+        Password::write(data, password.constData(), password.size());
+    }
+};
+
+struct AuthMessageReply
+{
+    typedef Field<qint8, Message::size> Verify;
+    typedef ReservedField<Verify::end, 3> Reserved;
+    typedef BytesField<Reserved::end, 32> Auth;
+    enum : int { size = Layout<Message::size, Verify, Reserved, Auth>::end };
+
+    Message message;
+    qint8 verify = 0;
+
+    static bool decode(const char *data, int available, AuthMessageReply *reply)
+    {
+        if (Q_UNLIKELY(available < Verify::end))
+            return false;
+        Message::decode(data, available, &reply->message);
+        reply->verify = Verify::read(data);
+        return true;
+    }
+};
+
+// The camera expects these fields in little endian, unlike the rest of the protocol.
+struct OpenStreamMessage
+{
+    typedef Field<quint32, PackageHeader::size, ByteOrder::LittleEndian> Channel;
+    typedef Field<quint32, Channel::end, ByteOrder::LittleEndian> Stream;
+    typedef Field<quint32, Stream::end, ByteOrder::LittleEndian> Opened;
+    typedef ReservedField<Opened::end, 4> Reserved;
+    enum : int { size = Layout<PackageHeader::size, Channel, Stream, Opened, Reserved>::end };
+
+    static void encode(char *data, quint32 channel, quint32 stream, bool opened,
+                       quint32 timestamp)
+    {
+        PackageHeader::encode(data, PackageType::OpenStream, packageSize<OpenStreamMessage>(),
+                              timestamp);
+        Channel::write(data, channel);
+        Stream::write(data, stream);
+        Opened::write(data, opened ? 0x01 : 0x00);
+        Reserved::write(data);
+    }
+};
+
+struct HeartbeatMessage
+{
+    typedef Field<qint8, PackageHeader::size> Payload;
+    enum : int { size = Layout<PackageHeader::size, Payload>::end };
+
+    static void encode(char *data, quint32 timestamp)
+    {
+        PackageHeader::encode(data, PackageType::Heartbeat, packageSize<HeartbeatMessage>(),
+                              timestamp);
+        Payload::write(data, 0x02); // Seems to always be 0x02
+    }
+};
+
+struct MediaMessage
+{
+    typedef Field<quint32, PackageHeader::size> Length;
+    typedef Field<MediaType, Length::end> Type;
+    typedef Field<qint8, Type::end> ChannelId;
+    enum : int { size = Layout<PackageHeader::size, Length, Type, ChannelId>::end };
+
+    PackageHeader header;
+    quint32 length = 0;
+    MediaType mediaType = MediaType::Audio;
+    qint8 channelId = 0;
+
+    static bool decode(const char *data, int available, MediaMessage *message)
+    {
+        if (Q_UNLIKELY(available < ChannelId::end))
+            return false;
+        PackageHeader::decode(data, available, &message->header);
+        message->length = Length::read(data);
+        message->mediaType = Type::read(data);
+        message->channelId = ChannelId::read(data);
+        return true;
+    }
+};
+
+static_assert(PackageHeader::size == 10, "Unexpected PackageHeader size");
+static_assert(Message::size == 18, "Unexpected Message size");
+static_assert(AuthMessage::size == 58, "Unexpected AuthMessage size");
+static_assert(AuthMessageReply::size == 54, "Unexpected AuthMessageReply size");
+static_assert(OpenStreamMessage::size == 26, "Unexpected OpenStreamMessage size");
+static_assert(HeartbeatMessage::size == 11, "Unexpected HeartbeatMessage size");
+static_assert(MediaMessage::size == 16, "Unexpected MediaMessage size");
+
+// Current time in microseconds, as used in package headers. We truncate the most
+// significant bits, as they won't fit into 32 bits.
+inline quint32 currentTimestamp()
+{
+    const qint64 microsecs = std::chrono::duration_cast<std::chrono::microseconds>(
+                                 std::chrono::system_clock::now().time_since_epoch())
+                                 .count();
+    return static_cast<quint32>(microsecs);
+}
+
+} // namespace BubbleProtocol
+
+#endif // BUBBLEPROTOCOL_H
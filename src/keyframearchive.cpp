@@ -0,0 +1,132 @@
+/*
+ *  BubbleCam Client
+ *
+ *  Copyright (c) 2018, Oleksii Serdiuk <contacts[at]oleksii[dot]name>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ *  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ *  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "keyframearchive.h"
+
+#include <QDataStream>
+#include <QDateTime>
+
+#define INDEX_MAGIC 0x42434b49 // "BCKI"
+#define INDEX_VERSION 1
+
+KeyFrameArchive::KeyFrameArchive() {}
+
+KeyFrameArchive::~KeyFrameArchive()
+{
+    close();
+}
+
+bool KeyFrameArchive::open(const QString &fileName)
+{
+    close();
+
+    m_data.setFileName(fileName);
+    if (!m_data.open(QFile::WriteOnly | QFile::Append)) {
+        m_errorString = m_data.errorString();
+        return false;
+    }
+
+    m_index.setFileName(fileName + QLatin1String(".idx"));
+    if (!m_index.open(QFile::WriteOnly | QFile::Append)) {
+        m_errorString = m_index.errorString();
+        m_data.close();
+        return false;
+    }
+
+    if (m_index.size() == 0) {
+        QDataStream out(&m_index);
+        out << quint32(INDEX_MAGIC) << quint32(INDEX_VERSION);
+        m_index.flush();
+    }
+    return true;
+}
+
+void KeyFrameArchive::close()
+{
+    if (!isOpen())
+        return;
+
+    abortFrame();
+    m_data.close();
+    m_index.close();
+}
+
+bool KeyFrameArchive::isOpen() const
+{
+    return m_data.isOpen();
+}
+
+QString KeyFrameArchive::errorString() const
+{
+    return m_errorString;
+}
+
+void KeyFrameArchive::beginFrame(quint32 size)
+{
+    if (!isOpen())
+        return;
+
+    abortFrame();
+    m_frameTime = QDateTime::currentMSecsSinceEpoch();
+    m_frameOffset = m_data.pos();
+    m_frameSize = size;
+    m_frameLeft = size;
+    m_frameOpen = true;
+}
+
+void KeyFrameArchive::appendFrame(const char *data, int size)
+{
+    if (!m_frameOpen || size <= 0)
+        return;
+
+    const quint32 n = qMin(m_frameLeft, quint32(size));
+    m_data.write(data, n);
+    m_frameLeft -= n;
+
+    if (m_frameLeft == 0) {
+        m_frameOpen = false;
+        // Frame has to be on disk before the record that points to it, so that a
+        // killed process leaves at most unindexed data behind
+        m_data.flush();
+        QDataStream out(&m_index);
+        out << m_frameTime << quint64(m_frameOffset) << m_frameSize;
+        m_index.flush();
+    }
+}
+
+void KeyFrameArchive::abortFrame()
+{
+    if (!m_frameOpen)
+        return;
+
+    // Drop the partially written frame, so that the data file only contains
+    // indexed frames
+    m_frameOpen = false;
+    m_data.flush();
+    m_data.resize(m_frameOffset);
+}
@@ -0,0 +1,71 @@
+/*
+ *  BubbleCam Client
+ *
+ *  Copyright (c) 2018, Oleksii Serdiuk <contacts[at]oleksii[dot]name>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ *  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ *  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef KEYFRAMEARCHIVE_H
+#define KEYFRAMEARCHIVE_H
+
+#include <QFile>
+#include <QString>
+
+// Time-lapse archive of IDR frames. Frames are appended to the data file as is,
+// and for each complete frame a record is appended to the index file
+// (`<name>.idx`): capture time in milliseconds since epoch (qint64), offset in
+// the data file (quint64) and frame size (quint32), all in big endian after a
+// "BCKI" magic and a quint32 version. Existing archives are appended to.
+class KeyFrameArchive
+{
+public:
+    KeyFrameArchive();
+    ~KeyFrameArchive();
+
+    bool open(const QString &fileName);
+    void close();
+    bool isOpen() const;
+    QString errorString() const;
+
+    // Starts a frame of the given size, which is filled by one or more
+    // appendFrame() calls. An unfinished previous frame is discarded.
+    void beginFrame(quint32 size);
+    void appendFrame(const char *data, int size);
+    void abortFrame();
+
+private:
+    Q_DISABLE_COPY(KeyFrameArchive)
+
+    QFile m_data;
+    QFile m_index;
+    QString m_errorString;
+
+    qint64 m_frameTime = 0;
+    qint64 m_frameOffset = 0;
+    quint32 m_frameSize = 0;
+    quint32 m_frameLeft = 0;
+    bool m_frameOpen = false;
+};
+
+#endif // KEYFRAMEARCHIVE_H
@@ -26,14 +26,26 @@
  *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "activitydetector.h"
 #include "bubblecamclient.h"
+#include "keyframearchive.h"
+#include "memorybudget.h"
+#include "sharedmemoryring.h"
+#include "tracer.h"
 
 #include <QCoreApplication>
 #include <QCommandLineParser>
 #include <QFile>
+#include <QSocketNotifier>
 
 #include <iostream>
 
+#ifdef Q_OS_UNIX
+#include <csignal>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
 #include <QLoggingCategory>
 Q_LOGGING_CATEGORY(bubbleCamMainLog, "bubblecam.main", QtWarningMsg)
 #define CRITICAL qCCritical(bubbleCamMainLog())
@@ -46,11 +58,20 @@ static struct
     QString password;
     QString videoFilePath;
     QString audioFilePath;
+    QString sharedMemoryName;
+    QString keyFrameArchivePath;
+    quint32 keyFrameInterval = 0;
+    QString traceFilePath;
+    quint32 sharedMemorySize = 16;
     quint16 port;
     quint8 channel;
     quint8 stream;
+    quint32 memoryLimit = 0;
+    BubbleCamClient::OverloadPolicy overloadPolicy = BubbleCamClient::OverloadPolicy::DropBuffered;
     quint8 verbosity = 3;
     bool debug = false;
+    bool fastStart = false;
+    qreal activitySensitivity = -1;
 } options;
 
 #include <QDateTime>
@@ -74,6 +95,30 @@ void parseCommandLine()
 
     parser.addOption(audioFile);
 
+    QCommandLineOption sharedMemoryOption(
+        "shm",
+        "Name of the shared memory ring buffer (e.g. '/bubblecam') to publish media packages to "
+        "for local consumers.",
+        "name");
+    parser.addOption(sharedMemoryOption);
+
+    QCommandLineOption sharedMemorySizeOption(
+        "shm-size", "Size of the shared memory ring buffer in MiB (default 16).", "size", "16");
+    parser.addOption(sharedMemorySizeOption);
+
+    QCommandLineOption keyFramesOption(
+        "keyframes",
+        "Record only key frames into a time-lapse archive at the given path, with an index in "
+        "'<path>.idx'. Other outputs then also receive only key frames.",
+        "path");
+    parser.addOption(keyFramesOption);
+
+    QCommandLineOption keyFrameIntervalOption(
+        "keyframe-interval",
+        "Keep at most one key frame per given number of seconds (default 0, keep all).",
+        "seconds", "0");
+    parser.addOption(keyFrameIntervalOption);
+
     QCommandLineOption portOption({ "P", "port" }, "Port to connect to (default 80).", "port",
                                   "80");
     parser.addOption(portOption);
@@ -99,6 +144,39 @@ void parseCommandLine()
                                     "number", "0");
     parser.addOption(streamOption);
 
+    QCommandLineOption fastStartOption(
+        "fast-start",
+        "Send all handshake packages at once instead of waiting for each reply. Reduces stream "
+        "start time on high latency links. Falls back to the usual handshake if the camera "
+        "doesn't support it.");
+    parser.addOption(fastStartOption);
+
+    QCommandLineOption activityOption(
+        "detect-activity",
+        "Report start and end of activity in the video stream, detected from package sizes "
+        "without decoding. Sensitivity is in range 0..1, 0.5 is a good start.",
+        "sensitivity");
+    parser.addOption(activityOption);
+
+    QCommandLineOption traceOption(
+        "trace",
+        "Record timing of the packet pipeline and write it on exit in Chrome trace format "
+        "(viewable in chrome://tracing or Perfetto UI).",
+        "path");
+    parser.addOption(traceOption);
+
+    QCommandLineOption memoryLimitOption(
+        "memory-limit", "Limit of memory used for buffering stream data, in MiB (default none).",
+        "size");
+    parser.addOption(memoryLimitOption);
+
+    QCommandLineOption overloadPolicyOption(
+        "overload-policy",
+        "What to do when memory limit is reached: 'drop' buffered data (default) or "
+        "'disconnect'.",
+        "policy", "drop");
+    parser.addOption(overloadPolicyOption);
+
     QCommandLineOption quietOption({ "q", "quiet" }, "Suppresses all output.");
     parser.addOption(quietOption);
 
@@ -133,11 +211,21 @@ void parseCommandLine()
         options.audioFilePath = parser.value(audioFile);
         pathProvided = true;
     }
+    if (parser.isSet(sharedMemoryOption)) {
+        options.sharedMemoryName = parser.value(sharedMemoryOption);
+        pathProvided = true;
+    }
+    if (parser.isSet(keyFramesOption)) {
+        options.keyFrameArchivePath = parser.value(keyFramesOption);
+        pathProvided = true;
+    }
     if (!pathProvided) {
-        CRITICAL << "Please, provide either video or audio file path." << endl;
+        CRITICAL << "Please, provide either video or audio file path, shared memory name or key "
+                    "frame archive path."
+                 << endl;
         parser.showHelp(1);
     }
-    if (options.videoFilePath == options.audioFilePath) {
+    if (!options.videoFilePath.isEmpty() && options.videoFilePath == options.audioFilePath) {
         CRITICAL << "Streaming both video and audio into the same file is not yet supported."
                  << endl;
     }
@@ -149,6 +237,18 @@ void parseCommandLine()
         parser.showHelp(1);
     }
 
+    options.keyFrameInterval = parser.value(keyFrameIntervalOption).toUInt(&ok);
+    if (!ok || options.keyFrameInterval > 24 * 60 * 60) {
+        CRITICAL << "Invalid key frame interval:" << parser.value(keyFrameIntervalOption) << endl;
+        parser.showHelp(1);
+    }
+
+    options.sharedMemorySize = parser.value(sharedMemorySizeOption).toUInt(&ok);
+    if (!ok || options.sharedMemorySize == 0 || options.sharedMemorySize > 1024) {
+        CRITICAL << "Invalid shared memory size:" << parser.value(sharedMemorySizeOption) << endl;
+        parser.showHelp(1);
+    }
+
     options.channel = static_cast<quint8>(parser.value(channelOption).toUShort(&ok));
     if (!ok) {
         CRITICAL << "Invalid channel number:" << parser.value(channelOption) << endl;
@@ -161,8 +261,36 @@ void parseCommandLine()
         parser.showHelp(1);
     }
 
+    if (parser.isSet(memoryLimitOption)) {
+        options.memoryLimit = parser.value(memoryLimitOption).toUInt(&ok);
+        if (!ok || options.memoryLimit == 0) {
+            CRITICAL << "Invalid memory limit:" << parser.value(memoryLimitOption) << endl;
+            parser.showHelp(1);
+        }
+    }
+
+    const QString overloadPolicy = parser.value(overloadPolicyOption);
+    if (overloadPolicy == "drop") {
+        options.overloadPolicy = BubbleCamClient::OverloadPolicy::DropBuffered;
+    } else if (overloadPolicy == "disconnect") {
+        options.overloadPolicy = BubbleCamClient::OverloadPolicy::Disconnect;
+    } else {
+        CRITICAL << "Invalid overload policy:" << overloadPolicy << endl;
+        parser.showHelp(1);
+    }
+
     options.username = parser.value(userOption);
     options.password = parser.value(passwordOption);
+    options.fastStart = parser.isSet(fastStartOption);
+    options.traceFilePath = parser.value(traceOption);
+
+    if (parser.isSet(activityOption)) {
+        options.activitySensitivity = parser.value(activityOption).toDouble(&ok);
+        if (!ok || options.activitySensitivity < 0 || options.activitySensitivity > 1) {
+            CRITICAL << "Invalid activity sensitivity:" << parser.value(activityOption) << endl;
+            parser.showHelp(1);
+        }
+    }
 
     const bool verbose = parser.isSet(verboseOption);
     const bool quiet = parser.isSet(quietOption);
@@ -218,6 +346,52 @@ void messageHandler(QtMsgType type, const QMessageLogContext &context, const QSt
     }
 }
 
+#ifdef Q_OS_UNIX
+static int terminationFds[2];
+
+static void terminationSignalHandler(int)
+{
+    // Only async-signal-safe calls here, the rest is done in the event loop
+    const char c = 1;
+    const ssize_t written = ::write(terminationFds[1], &c, sizeof(c));
+    Q_UNUSED(written);
+}
+
+// Quits the event loop on SIGINT and SIGTERM, so that outputs are closed and the
+// trace is written on exit. Only useful once the event loop is about to run, until
+// then signals keep their default action.
+void installTerminationHandler()
+{
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, terminationFds) != 0) {
+        CRITICAL << "Failed to set up signal handling";
+        return;
+    }
+
+    QSocketNotifier *notifier =
+        new QSocketNotifier(terminationFds[0], QSocketNotifier::Read, QCoreApplication::instance());
+    QObject::connect(notifier, &QSocketNotifier::activated, [notifier]() {
+        notifier->setEnabled(false);
+        char c;
+        const ssize_t received = ::read(terminationFds[0], &c, sizeof(c));
+        Q_UNUSED(received);
+        // A second signal terminates right away, e.g. if stopping hangs
+        ::signal(SIGINT, SIG_DFL);
+        ::signal(SIGTERM, SIG_DFL);
+        INFO << "Stopping";
+        QCoreApplication::quit();
+    });
+
+    struct sigaction action = {};
+    action.sa_handler = terminationSignalHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+}
+#else
+void installTerminationHandler() {}
+#endif
+
 int main(int argc, char *argv[])
 {
     QCoreApplication app(argc, argv);
@@ -255,7 +429,35 @@ int main(int argc, char *argv[])
         break;
     }
 
+    Tracer::setEnabled(!options.traceFilePath.isEmpty());
+
+    SharedMemoryRing ring;
+    if (!options.sharedMemoryName.isEmpty()) {
+        if (!ring.create(options.sharedMemoryName, options.sharedMemorySize * 1024 * 1024)) {
+            CRITICAL << "Failed to create shared memory ring:" << ring.errorString();
+            return 1;
+        }
+    }
+
+    MemoryBudget::instance()->setLimit(qint64(options.memoryLimit) * 1024 * 1024);
+
+    KeyFrameArchive archive;
+    if (!options.keyFrameArchivePath.isEmpty()) {
+        if (!archive.open(options.keyFrameArchivePath)) {
+            CRITICAL << "Failed to open key frame archive:" << archive.errorString();
+            return 1;
+        }
+    }
+
     BubbleCamClient client;
+    client.setFastStart(options.fastStart);
+    client.setOverloadPolicy(options.overloadPolicy);
+    if (archive.isOpen()) {
+        client.setKeyFramesOnly(true, int(options.keyFrameInterval) * 1000);
+        client.setKeyFrameArchive(&archive);
+    }
+    if (ring.isOpen())
+        client.setSharedMemoryRing(&ring);
     BubbleCamClient::ErrorCode error =
         client.startStreaming(options.host, options.port, options.username, options.password,
                               options.channel, options.stream);
@@ -265,16 +467,28 @@ int main(int argc, char *argv[])
     }
     INFO << "Successfully started stream";
 
+    installTerminationHandler();
+
+    // Stream is stopped on disconnects and errors, there is nothing left to do then
+    QObject::connect(&client, &BubbleCamClient::streamingStopped, &app,
+                     &QCoreApplication::quit, Qt::QueuedConnection);
+
     QFile v;
-    if (options.videoFilePath == "-") {
-        v.open(stdout, QFile::WriteOnly);
-    } else {
-        v.setFileName(options.videoFilePath);
-        v.open(QFile::WriteOnly);
-    }
+    if (!options.videoFilePath.isEmpty()) {
+        if (options.videoFilePath == "-") {
+            v.open(stdout, QFile::WriteOnly);
+        } else {
+            v.setFileName(options.videoFilePath);
+            v.open(QFile::WriteOnly);
+        }
 
-    QObject::connect(&client, &BubbleCamClient::videoStream,
-                     [&v](const QByteArray &data) { v.write(data); });
+        const quint32 session = client.sessionId();
+        QObject::connect(&client, &BubbleCamClient::videoStream,
+                         [&v, session](const QByteArray &data) {
+                             TRACE_SPAN("disk write", session);
+                             v.write(data);
+                         });
+    }
 
     QFile a;
     if (!options.audioFilePath.isEmpty()) {
@@ -285,8 +499,23 @@ int main(int argc, char *argv[])
             a.open(QFile::WriteOnly);
         }
 
+        const quint32 session = client.sessionId();
         QObject::connect(&client, &BubbleCamClient::audioStream,
-                         [&a](const QByteArray &data) { a.write(data.mid(36)); });
+                         [&a, session](const QByteArray &data) {
+                             TRACE_SPAN("disk write", session);
+                             a.write(data.mid(36));
+                         });
+    }
+
+    ActivityDetector detector;
+    if (options.activitySensitivity >= 0) {
+        detector.setSensitivity(options.activitySensitivity);
+        QObject::connect(&client, &BubbleCamClient::videoPacketReceived, &detector,
+                         &ActivityDetector::addVideoPacket);
+        QObject::connect(&detector, &ActivityDetector::activityStarted,
+                         []() { INFO << "Activity started"; });
+        QObject::connect(&detector, &ActivityDetector::activityEnded,
+                         []() { INFO << "Activity ended"; });
     }
 
     const int ret = app.exec();
@@ -294,6 +523,13 @@ int main(int argc, char *argv[])
     client.stopStreaming();
     v.close();
     a.close();
+    archive.close();
+
+    if (Tracer::isEnabled()) {
+        Tracer::setEnabled(false);
+        if (!Tracer::writeChromeTrace(options.traceFilePath))
+            CRITICAL << "Failed to write trace to" << options.traceFilePath;
+    }
 
     return ret;
 }
@@ -0,0 +1,151 @@
+/*
+ *  BubbleCam Client
+ *
+ *  Copyright (c) 2018, Oleksii Serdiuk <contacts[at]oleksii[dot]name>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ *  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ *  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "memorybudget.h"
+
+#include <QPair>
+
+#include <algorithm>
+
+#include <QLoggingCategory>
+Q_LOGGING_CATEGORY(memoryBudgetLog, "bubblecam.MemoryBudget", QtWarningMsg)
+#define WARNING qCWarning(memoryBudgetLog())
+
+MemoryBudget::Account::Account() : m_budget(MemoryBudget::instance()), m_total(0)
+{
+    for (std::atomic<qint64> &usage : m_usage)
+        usage.store(0, std::memory_order_relaxed);
+    m_budget->add(this);
+}
+
+MemoryBudget::Account::~Account()
+{
+    m_budget->remove(this);
+    m_budget->m_usage.fetch_sub(m_total.load());
+}
+
+void MemoryBudget::Account::setUsage(Category category, qint64 bytes)
+{
+    const qint64 delta = bytes - m_usage[int(category)].exchange(bytes);
+    if (delta == 0)
+        return;
+
+    m_total.fetch_add(delta);
+    const qint64 total = m_budget->m_usage.fetch_add(delta) + delta;
+    const qint64 limit = m_budget->m_limit.load(std::memory_order_relaxed);
+    if (delta > 0 && limit > 0 && total > limit)
+        m_budget->enforce();
+}
+
+qint64 MemoryBudget::Account::usage(Category category) const
+{
+    return m_usage[int(category)].load();
+}
+
+qint64 MemoryBudget::Account::usage() const
+{
+    return m_total.load();
+}
+
+void MemoryBudget::Account::setOverloadHandler(const std::function<void()> &handler)
+{
+    QMutexLocker locker(&m_budget->m_mutex);
+    m_overloadHandler = handler;
+}
+
+MemoryBudget::MemoryBudget() : m_limit(0), m_usage(0), m_enforcing(false) {}
+
+MemoryBudget *MemoryBudget::instance()
+{
+    static MemoryBudget budget;
+    return &budget;
+}
+
+void MemoryBudget::setLimit(qint64 bytes)
+{
+    m_limit.store(qMax<qint64>(0, bytes));
+    if (bytes > 0 && m_usage.load() > bytes)
+        enforce();
+}
+
+qint64 MemoryBudget::limit() const
+{
+    return m_limit.load();
+}
+
+qint64 MemoryBudget::usage() const
+{
+    return m_usage.load();
+}
+
+void MemoryBudget::add(Account *account)
+{
+    QMutexLocker locker(&m_mutex);
+    m_accounts.append(account);
+}
+
+void MemoryBudget::remove(Account *account)
+{
+    QMutexLocker locker(&m_mutex);
+    m_accounts.removeOne(account);
+}
+
+void MemoryBudget::enforce()
+{
+    // Another thread is already enforcing, it would request the same releases
+    if (m_enforcing.exchange(true))
+        return;
+
+    {
+        // Accounts are removed under the same lock, so they stay valid until the
+        // handlers are called
+        QMutexLocker locker(&m_mutex);
+        QVector<QPair<qint64, Account *>> offenders;
+        offenders.reserve(m_accounts.size());
+        for (Account *account : m_accounts) {
+            if (account->m_overloadHandler && account->usage() > 0)
+                offenders.append(qMakePair(account->usage(), account));
+        }
+        std::sort(offenders.begin(), offenders.end(),
+                  [](const QPair<qint64, Account *> &a, const QPair<qint64, Account *> &b) {
+                      return a.first > b.first;
+                  });
+
+        const qint64 limit = m_limit.load();
+        qint64 expected = m_usage.load();
+        WARNING << "Memory usage" << expected << "is over the limit" << limit;
+        for (const auto &offender : offenders) {
+            if (expected <= limit)
+                break;
+            offender.second->m_overloadHandler();
+            expected -= offender.first;
+        }
+    }
+
+    m_enforcing.store(false);
+}
@@ -0,0 +1,95 @@
+/*
+ *  BubbleCam Client
+ *
+ *  Copyright (c) 2018, Oleksii Serdiuk <contacts[at]oleksii[dot]name>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ *  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ *  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+#include <QMutex>
+#include <QVector>
+
+#include <atomic>
+#include <functional>
+
+// Process-wide accounting of memory held by streaming sessions. Each session
+// reports its buffers through an Account. When the total goes over the limit,
+// overload handlers of the accounts are called, largest account first, until
+// the expected usage fits into the limit again. Handlers run on the thread that
+// went over the limit, with the budget locked, so accounts can't go away while
+// they are called.
+class MemoryBudget
+{
+public:
+    enum class Category { ReceiveBuffer = 0, ReassemblyBuffer, WriterQueue, Cache, Count };
+
+    class Account
+    {
+    public:
+        Account();
+        ~Account();
+
+        void setUsage(Category category, qint64 bytes);
+        qint64 usage(Category category) const;
+        qint64 usage() const;
+
+        // Called when this account has to free memory, from any thread and with
+        // the budget locked. Must only request the release from the thread owning
+        // the session (e.g. with a queued call), and must not report usage itself.
+        void setOverloadHandler(const std::function<void()> &handler);
+
+    private:
+        Q_DISABLE_COPY(Account)
+        friend class MemoryBudget;
+
+        MemoryBudget *m_budget;
+        std::atomic<qint64> m_usage[int(Category::Count)];
+        std::atomic<qint64> m_total;
+        std::function<void()> m_overloadHandler;
+    };
+
+    static MemoryBudget *instance();
+
+    // Zero means no limit
+    void setLimit(qint64 bytes);
+    qint64 limit() const;
+    qint64 usage() const;
+
+private:
+    void add(Account *account);
+    void remove(Account *account);
+    void enforce();
+
+    std::atomic<qint64> m_limit;
+    std::atomic<qint64> m_usage;
+    std::atomic<bool> m_enforcing;
+    QMutex m_mutex;
+    QVector<Account *> m_accounts;
+
+    MemoryBudget();
+};
+
+#endif // MEMORYBUDGET_H
@@ -0,0 +1,345 @@
+/*
+ *  BubbleCam Client
+ *
+ *  Copyright (c) 2018, Oleksii Serdiuk <contacts[at]oleksii[dot]name>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ *  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ *  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "sharedmemoryring.h"
+
+#include <atomic>
+#include <cstring>
+#include <new>
+
+#ifdef Q_OS_UNIX
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define RING_MAGIC 0x62636d72 // "bcmr"
+#define RING_VERSION 1
+
+#if ATOMIC_LLONG_LOCK_FREE != 2
+#error "Shared memory ring requires lock-free 64-bit atomics"
+#endif
+
+struct alignas(64) SharedMemoryRingHeader
+{
+    quint32 magic;
+    quint32 version;
+    quint64 capacity;
+    // End of the entry being written. Data before `reserved - capacity` may be
+    // overwritten at any moment.
+    std::atomic<quint64> reserved;
+    // End of the last complete entry
+    std::atomic<quint64> published;
+};
+
+typedef SharedMemoryRing::Entry Entry;
+typedef SharedMemoryRing::PacketType PacketType;
+static_assert(sizeof(Entry) == 24, "Unexpected ring entry size");
+
+static inline quint64 entrySize(quint64 payloadSize)
+{
+    return (sizeof(Entry) + payloadSize + 7) & ~quint64(7);
+}
+
+SharedMemoryRing::SharedMemoryRing() {}
+
+SharedMemoryRing::~SharedMemoryRing()
+{
+    close();
+}
+
+bool SharedMemoryRing::create(const QString &name, quint32 capacity)
+{
+    close();
+
+#ifdef Q_OS_UNIX
+    m_name = name.toLocal8Bit();
+    m_capacity = (quint64(capacity) + 7) & ~quint64(7);
+    m_mappedSize = sizeof(SharedMemoryRingHeader) + m_capacity;
+
+    const int fd = shm_open(m_name.constData(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) {
+        m_errorString = QString::fromLocal8Bit(strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd, off_t(m_mappedSize)) != 0) {
+        m_errorString = QString::fromLocal8Bit(strerror(errno));
+        ::close(fd);
+        shm_unlink(m_name.constData());
+        return false;
+    }
+    void *memory = mmap(nullptr, m_mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        m_errorString = QString::fromLocal8Bit(strerror(errno));
+        shm_unlink(m_name.constData());
+        return false;
+    }
+
+    m_header = new (memory) SharedMemoryRingHeader;
+    m_header->magic = RING_MAGIC;
+    m_header->version = RING_VERSION;
+    m_header->capacity = m_capacity;
+    m_header->reserved.store(0, std::memory_order_relaxed);
+    m_header->published.store(0, std::memory_order_release);
+    m_data = static_cast<char *>(memory) + sizeof(SharedMemoryRingHeader);
+
+    m_sequence = 0;
+    m_head = 0;
+    m_reserved = 0;
+    m_packetOpen = false;
+    return true;
+#else
+    Q_UNUSED(name);
+    Q_UNUSED(capacity);
+    m_errorString = QLatin1String("Shared memory output is not supported on this platform");
+    return false;
+#endif
+}
+
+void SharedMemoryRing::close()
+{
+#ifdef Q_OS_UNIX
+    if (!m_header)
+        return;
+
+    munmap(m_header, m_mappedSize);
+    // Consumers that already mapped the ring keep their mapping
+    shm_unlink(m_name.constData());
+    m_header = nullptr;
+    m_data = nullptr;
+#endif
+}
+
+bool SharedMemoryRing::isOpen() const
+{
+    return m_header != nullptr;
+}
+
+QString SharedMemoryRing::errorString() const
+{
+    return m_errorString;
+}
+
+bool SharedMemoryRing::beginPacket(PacketType type, quint8 channel, quint32 timestamp,
+                                   quint32 size)
+{
+    if (m_packetOpen)
+        abortPacket();
+
+    const quint64 total = entrySize(size);
+    if (!m_header || total > m_capacity / 2)
+        return false;
+
+    quint64 position = m_head;
+    const quint64 offset = position % m_capacity;
+    quint64 padding = 0;
+    if (m_capacity - offset < total)
+        padding = m_capacity - offset;
+
+    // Announce the region we're about to overwrite before touching it, so that
+    // consumers still reading it notice. After an aborted package the new end
+    // can be lower, but the bytes it overwrote must stay announced.
+    m_reserved = qMax(m_reserved, position + padding + total);
+    m_header->reserved.store(m_reserved, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    if (padding >= sizeof(Entry)) {
+        Entry pad = {};
+        pad.type = PacketType::Padding;
+        pad.size = quint32(padding - sizeof(Entry));
+        memcpy(m_data + offset, &pad, sizeof(Entry));
+    }
+    position += padding;
+
+    Entry entry = {};
+    entry.sequence = m_sequence;
+    entry.size = size;
+    entry.timestamp = timestamp;
+    entry.type = type;
+    entry.channel = channel;
+    memcpy(m_data + position % m_capacity, &entry, sizeof(Entry));
+
+    m_head = position;
+    m_packetWrite = position + sizeof(Entry);
+    m_packetEnd = m_packetWrite + size;
+    m_packetOpen = true;
+    if (size == 0)
+        appendPacket(nullptr, 0);
+    return true;
+}
+
+void SharedMemoryRing::appendPacket(const char *data, int size)
+{
+    if (!m_packetOpen)
+        return;
+
+    const quint64 n = qMin<quint64>(quint64(qMax(0, size)), m_packetEnd - m_packetWrite);
+    if (n > 0) {
+        memcpy(m_data + m_packetWrite % m_capacity, data, n);
+        m_packetWrite += n;
+    }
+
+    if (m_packetWrite == m_packetEnd) {
+        m_head += entrySize(m_packetEnd - m_head - sizeof(Entry));
+        ++m_sequence;
+        m_packetOpen = false;
+        m_header->published.store(m_head, std::memory_order_release);
+    }
+}
+
+void SharedMemoryRing::abortPacket()
+{
+    // Nothing was published, the reserved space is reused by the next package
+    m_packetOpen = false;
+}
+
+bool SharedMemoryRing::isPacketOpen() const
+{
+    return m_packetOpen;
+}
+
+SharedMemoryRingReader::SharedMemoryRingReader() {}
+
+SharedMemoryRingReader::~SharedMemoryRingReader()
+{
+    close();
+}
+
+bool SharedMemoryRingReader::open(const QString &name)
+{
+    close();
+
+#ifdef Q_OS_UNIX
+    const QByteArray nativeName = name.toLocal8Bit();
+    const int fd = shm_open(nativeName.constData(), O_RDONLY, 0);
+    if (fd < 0) {
+        m_errorString = QString::fromLocal8Bit(strerror(errno));
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(SharedMemoryRingHeader)) {
+        m_errorString = QLatin1String("Shared memory object is too small");
+        ::close(fd);
+        return false;
+    }
+    m_mappedSize = size_t(info.st_size);
+    void *memory = mmap(nullptr, m_mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        m_errorString = QString::fromLocal8Bit(strerror(errno));
+        return false;
+    }
+
+    const SharedMemoryRingHeader *header = static_cast<const SharedMemoryRingHeader *>(memory);
+    if (header->magic != RING_MAGIC || header->version != RING_VERSION
+        || header->capacity + sizeof(SharedMemoryRingHeader) > m_mappedSize) {
+        m_errorString = QLatin1String("Not a BubbleCam shared memory ring");
+        munmap(memory, m_mappedSize);
+        return false;
+    }
+
+    m_header = header;
+    m_data = static_cast<const char *>(memory) + sizeof(SharedMemoryRingHeader);
+    m_capacity = header->capacity;
+    m_position = header->published.load(std::memory_order_acquire);
+    return true;
+#else
+    Q_UNUSED(name);
+    m_errorString = QLatin1String("Shared memory output is not supported on this platform");
+    return false;
+#endif
+}
+
+void SharedMemoryRingReader::close()
+{
+#ifdef Q_OS_UNIX
+    if (!m_header)
+        return;
+
+    munmap(const_cast<SharedMemoryRingHeader *>(m_header), m_mappedSize);
+    m_header = nullptr;
+    m_data = nullptr;
+#endif
+}
+
+bool SharedMemoryRingReader::isOpen() const
+{
+    return m_header != nullptr;
+}
+
+QString SharedMemoryRingReader::errorString() const
+{
+    return m_errorString;
+}
+
+SharedMemoryRingReader::ReadResult SharedMemoryRingReader::read(SharedMemoryRing::Entry *entry,
+                                                                QByteArray *payload)
+{
+    if (!m_header)
+        return ReadResult::NoData;
+
+    forever {
+        const quint64 published = m_header->published.load(std::memory_order_acquire);
+        if (m_position == published)
+            return ReadResult::NoData;
+        if (published - m_position > m_capacity) {
+            m_position = published;
+            return ReadResult::Overrun;
+        }
+
+        const quint64 offset = m_position % m_capacity;
+        if (m_capacity - offset < sizeof(Entry)) {
+            m_position += m_capacity - offset;
+            continue;
+        }
+
+        memcpy(entry, m_data + offset, sizeof(Entry));
+        const quint64 total =
+            entry->type == PacketType::Padding ? m_capacity - offset : entrySize(entry->size);
+        const bool valid = offset + total <= m_capacity;
+        if (valid && entry->type != PacketType::Padding) {
+            payload->resize(int(entry->size));
+            memcpy(payload->data(), m_data + offset + sizeof(Entry), entry->size);
+        }
+
+        // Producer might have overwritten the entry while we were copying it
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (!valid
+            || m_header->reserved.load(std::memory_order_relaxed) - m_position > m_capacity) {
+            m_position = m_header->published.load(std::memory_order_acquire);
+            return ReadResult::Overrun;
+        }
+
+        m_position += total;
+        if (entry->type != PacketType::Padding)
+            return ReadResult::Ok;
+    }
+}
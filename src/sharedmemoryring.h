@@ -0,0 +1,124 @@
+/*
+ *  BubbleCam Client
+ *
+ *  Copyright (c) 2018, Oleksii Serdiuk <contacts[at]oleksii[dot]name>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ *  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ *  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SHAREDMEMORYRING_H
+#define SHAREDMEMORYRING_H
+
+#include <QByteArray>
+#include <QString>
+
+struct SharedMemoryRingHeader;
+
+// Single-producer/multi-consumer ring buffer of media packages in POSIX shared
+// memory (i.e. /dev/shm on Linux). The producer never waits for consumers:
+// each consumer tracks its own position and detects being overrun by the
+// producer, in which case it skips to the newest data.
+//
+// Each entry is an 8-byte aligned SharedMemoryRing::Entry header followed by
+// the payload. Entries never wrap around the end of the buffer; a Padding
+// entry (or less than an entry header of free space) marks the jump to the
+// beginning.
+class SharedMemoryRing
+{
+public:
+    enum class PacketType : quint8 { Audio = 0x00, Idr, PSlice, Padding = 0xff };
+
+    struct Entry
+    {
+        quint64 sequence;
+        quint32 size;
+        quint32 timestamp;
+        PacketType type;
+        quint8 channel;
+        quint8 reserved[6];
+    };
+
+    SharedMemoryRing();
+    ~SharedMemoryRing();
+
+    // Name is used as is for shm_open(), e.g. "/bubblecam-front-door"
+    bool create(const QString &name, quint32 capacity);
+    void close();
+    bool isOpen() const;
+    QString errorString() const;
+
+    // Reserves space for a package of the given payload size, which is then
+    // filled by one or more appendPacket() calls. The package becomes visible
+    // to consumers once all of its payload is appended.
+    bool beginPacket(PacketType type, quint8 channel, quint32 timestamp, quint32 size);
+    void appendPacket(const char *data, int size);
+    void abortPacket();
+    bool isPacketOpen() const;
+
+private:
+    Q_DISABLE_COPY(SharedMemoryRing)
+
+    QByteArray m_name;
+    QString m_errorString;
+    SharedMemoryRingHeader *m_header = nullptr;
+    char *m_data = nullptr;
+    size_t m_mappedSize = 0;
+    quint64 m_capacity = 0;
+
+    quint64 m_sequence = 0;
+    quint64 m_head = 0;
+    quint64 m_reserved = 0;
+    quint64 m_packetEnd = 0;
+    quint64 m_packetWrite = 0;
+    bool m_packetOpen = false;
+};
+
+class SharedMemoryRingReader
+{
+public:
+    enum class ReadResult { Ok, NoData, Overrun };
+
+    SharedMemoryRingReader();
+    ~SharedMemoryRingReader();
+
+    // Starts reading from the newest data in the ring
+    bool open(const QString &name);
+    void close();
+    bool isOpen() const;
+    QString errorString() const;
+
+    // On Overrun some entries were lost and reading continues with the newest data
+    ReadResult read(SharedMemoryRing::Entry *entry, QByteArray *payload);
+
+private:
+    Q_DISABLE_COPY(SharedMemoryRingReader)
+
+    QString m_errorString;
+    const SharedMemoryRingHeader *m_header = nullptr;
+    const char *m_data = nullptr;
+    size_t m_mappedSize = 0;
+    quint64 m_capacity = 0;
+    quint64 m_position = 0;
+};
+
+#endif // SHAREDMEMORYRING_H
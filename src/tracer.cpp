@@ -0,0 +1,123 @@
+/*
+ *  BubbleCam Client
+ *
+ *  Copyright (c) 2018, Oleksii Serdiuk <contacts[at]oleksii[dot]name>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ *  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ *  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "tracer.h"
+
+#include <QFile>
+#include <QMutex>
+#include <QTextStream>
+#include <QVector>
+
+// Number of spans kept per thread
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+namespace {
+
+struct TraceEvent
+{
+    const char *name;
+    quint32 session;
+    qint64 begin;
+    qint64 end;
+};
+
+struct TraceBuffer
+{
+    int threadIndex;
+    quint64 count = 0;
+    TraceEvent events[TRACE_BUFFER_SIZE];
+};
+
+QMutex buffersMutex;
+// Buffers are never freed, so that spans of finished threads can still be written
+QVector<TraceBuffer *> buffers;
+
+thread_local TraceBuffer *threadBuffer = nullptr;
+
+TraceBuffer *createThreadBuffer()
+{
+    QMutexLocker locker(&buffersMutex);
+    TraceBuffer *buffer = new TraceBuffer;
+    buffer->threadIndex = buffers.size() + 1;
+    buffers.append(buffer);
+    return buffer;
+}
+
+} // namespace
+
+std::atomic<bool> Tracer::s_enabled(false);
+
+void Tracer::setEnabled(bool enabled)
+{
+    s_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void Tracer::record(const char *name, quint32 session, qint64 begin, qint64 end)
+{
+    if (Q_UNLIKELY(!threadBuffer))
+        threadBuffer = createThreadBuffer();
+
+    TraceEvent &event = threadBuffer->events[threadBuffer->count % TRACE_BUFFER_SIZE];
+    event.name = name;
+    event.session = session;
+    event.begin = begin;
+    event.end = end;
+    ++threadBuffer->count;
+}
+
+bool Tracer::writeChromeTrace(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate))
+        return false;
+
+    QTextStream out(&file);
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+    QMutexLocker locker(&buffersMutex);
+    bool first = true;
+    for (const TraceBuffer *buffer : buffers) {
+        const quint64 count = qMin<quint64>(buffer->count, TRACE_BUFFER_SIZE);
+        for (quint64 i = buffer->count - count; i < buffer->count; ++i) {
+            const TraceEvent &event = buffer->events[i % TRACE_BUFFER_SIZE];
+            if (!first)
+                out << ",";
+            first = false;
+            // Timestamps are in microseconds, fractions keep nanosecond precision
+            out << "\n{\"name\":\"" << event.name << "\",\"cat\":\"bubblecam\",\"ph\":\"X\""
+                << ",\"ts\":" << QString::number(event.begin / 1000.0, 'f', 3)
+                << ",\"dur\":" << QString::number((event.end - event.begin) / 1000.0, 'f', 3)
+                << ",\"pid\":1,\"tid\":" << buffer->threadIndex
+                << ",\"args\":{\"session\":" << event.session << "}}";
+        }
+    }
+    out << "\n]}\n";
+    out.flush();
+
+    return file.error() == QFile::NoError;
+}
@@ -0,0 +1,92 @@
+/*
+ *  BubbleCam Client
+ *
+ *  Copyright (c) 2018, Oleksii Serdiuk <contacts[at]oleksii[dot]name>
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ *  * Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ *  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ *  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ *  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <QString>
+
+#include <atomic>
+#include <chrono>
+
+// Opt-in span tracing of the packet pipeline. Each thread records into its own
+// fixed-size ring buffer without locking, the oldest spans being overwritten.
+// When tracing is disabled, a span costs a single relaxed atomic load.
+class Tracer
+{
+public:
+    static void setEnabled(bool enabled);
+    static inline bool isEnabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+    static void record(const char *name, quint32 session, qint64 begin, qint64 end);
+
+    // Writes recorded spans in Chrome trace event format, which can be opened
+    // in chrome://tracing or Perfetto UI. Should be called after tracing is
+    // disabled, as the buffers are read without synchronization.
+    static bool writeChromeTrace(const QString &fileName);
+
+    static inline qint64 now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+private:
+    static std::atomic<bool> s_enabled;
+};
+
+// Records the time between construction and destruction. Name must be a
+// string literal, as only the pointer is stored.
+class TraceSpan
+{
+public:
+    inline TraceSpan(const char *name, quint32 session)
+        : m_name(name), m_session(session), m_begin(Tracer::isEnabled() ? Tracer::now() : 0)
+    {
+    }
+
+    inline ~TraceSpan()
+    {
+        if (m_begin != 0 && Tracer::isEnabled())
+            Tracer::record(m_name, m_session, m_begin, Tracer::now());
+    }
+
+private:
+    Q_DISABLE_COPY(TraceSpan)
+
+    const char *m_name;
+    quint32 m_session;
+    qint64 m_begin;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SPAN(name, session) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name, session)
+
+#endif // TRACER_H